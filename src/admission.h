@@ -0,0 +1,112 @@
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+// Header file for admission control
+// Measures how long each request waited since its data arrived, including the time spent in the kernel backlog
+// The kernel keeps that age in TCP_INFO's tcpi_last_data_recv, with millisecond precision
+// Requests that waited more than the target are answered with a pre-encoded 503 before any parsing or db access
+// Forwarded requests carry their arrival, the owner sheds them a margin before the target so its answer can reach
+// the forwarding instance, where the clients still waiting at the target get a 504 since the owner may have applied them
+// Shedding the stale requests cheaply lets the loop catch up, so admitted requests keep a bounded latency
+
+#include <netinet/tcp.h>
+
+#include "httpHandler.h"
+
+// Max time a request may wait between arriving and being read, overridden by the ADMISSION_TARGET_MS env variable
+// 0 disables admission control
+#define ADMISSION_TARGET_MS 250
+// Forwarded requests are shed this much before the target on the owner, at most half of the target
+#define FORWARDED_ADMISSION_MARGIN_MS 50
+// Arrival of a request that was never measured, it is always admitted
+#define ARRIVAL_UNKNOWN 0
+
+int admissionTargetMs = 0;
+unsigned long admittedRequests = 0;
+unsigned long shedRequests = 0;
+
+// Reads the target from the ADMISSION_TARGET_MS env variable, falling back to ADMISSION_TARGET_MS
+void setupAdmission();
+
+// Returns when the client's request arrived, in getMonotonicMicros time
+// CLOCK_MONOTONIC is shared by the processes of a host, so the arrival can be sent to another instance
+// Returns the current time if the age is unknown
+// Returns ARRIVAL_UNKNOWN without any syscall when admission control is disabled
+long long getRequestArrival(int clientSocket);
+
+// Returns true if a request that arrived at arrivedAt waited longer than the target and should be shed
+bool shouldShed(long long arrivedAt);
+
+// Same as shouldShed, for a request forwarded by another instance, using the target minus FORWARDED_ADMISSION_MARGIN_MS
+bool shouldShedForwarded(long long arrivedAt);
+
+// Returns the time after which a request that arrived at arrivedAt should be shed
+// Returns fallback if admission control is disabled, the arrival is unknown or fallback comes first
+long long getAdmissionDeadline(long long arrivedAt, long long fallback);
+
+// Prints the admitted and shed counters
+void printAdmissionStats();
+
+void setupAdmission() {
+    admissionTargetMs = ADMISSION_TARGET_MS;
+    const char* targetEnv = getenv("ADMISSION_TARGET_MS");
+    if (targetEnv != NULL) {
+        admissionTargetMs = atoi(targetEnv);
+    }
+}
+
+long long getRequestArrival(int clientSocket) {
+    if (admissionTargetMs <= 0) {
+        return ARRIVAL_UNKNOWN;
+    }
+    long long now = getMonotonicMicros();
+    struct tcp_info info;
+    socklen_t infoSize = sizeof(info);
+    if (getsockopt(clientSocket, IPPROTO_TCP, TCP_INFO, &info, &infoSize) == ERROR) {
+        return now;
+    }
+    return now - info.tcpi_last_data_recv * 1000LL;
+}
+
+// Returns true if the request waited more than maxDelayMs and counts the decision
+bool shedIfOlderThan(long long arrivedAt, int maxDelayMs) {
+    if (admissionTargetMs <= 0 || arrivedAt == ARRIVAL_UNKNOWN) {
+        admittedRequests++;
+        return false;
+    }
+
+    long long queueingDelay = getMonotonicMicros() - arrivedAt;
+    if (queueingDelay > maxDelayMs * 1000LL) {
+        shedRequests++;
+        log("[ Service Unavailable - waited %lldus ]\n", queueingDelay);
+        return true;
+    }
+
+    admittedRequests++;
+    return false;
+}
+
+bool shouldShed(long long arrivedAt) {
+    return shedIfOlderThan(arrivedAt, admissionTargetMs);
+}
+
+bool shouldShedForwarded(long long arrivedAt) {
+    int margin = FORWARDED_ADMISSION_MARGIN_MS;
+    if (margin > admissionTargetMs / 2) {
+        margin = admissionTargetMs / 2;
+    }
+    return shedIfOlderThan(arrivedAt, admissionTargetMs - margin);
+}
+
+long long getAdmissionDeadline(long long arrivedAt, long long fallback) {
+    if (admissionTargetMs <= 0 || arrivedAt == ARRIVAL_UNKNOWN) {
+        return fallback;
+    }
+    long long deadline = arrivedAt + admissionTargetMs * 1000LL;
+    return deadline < fallback ? deadline : fallback;
+}
+
+void printAdmissionStats() {
+    printf("{ Admitted: %lu, Shed: %lu }\n", admittedRequests, shedRequests);
+}
+#endif
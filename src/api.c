@@ -1,4 +1,9 @@
-#include "httpHandler.h"
+// For sched_setaffinity in busyPoll.h
+#define _GNU_SOURCE
+
+#include "admission.h"
+#include "busyPoll.h"
+#include "shard.h"
 
 int serverSocket;
 
@@ -6,12 +11,15 @@ int serverSocket;
 void signal_callback_handler(int signum) {
     printf("{ Caught signal %d }\n", signum);
     close(serverSocket);
+    closeShard();
+    printAdmissionStats();
+    printBusyPollStats();
     exit(EXIT_SUCCESS);
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Usage: %s <port>\n", argv[0]);
+    if (argc != 2 && argc != 4) {
+        printf("Usage: %s <port> [<shard index> <shard count>]\n", argv[0]);
         return ERROR;
     }
 
@@ -25,6 +33,8 @@ int main(int argc, char* argv[]) {
 #endif
 
     serverSocket = setupServer(SERVER_PORT, SERVER_BACKLOG);
+    setupAdmission();
+    setupBusyPoll(serverSocket);
 
     signal(SIGINT, signal_callback_handler);
     signal(SIGTERM, signal_callback_handler);
@@ -32,32 +42,56 @@ int main(int argc, char* argv[]) {
     log("{ Server is running(%d) }\n", serverSocket);
     log("{ Listening on port %d }\n", SERVER_PORT);
     log("{ FD_SETSIZE: %d }\n", FD_SETSIZE);
+    log("{ Admission target: %dms }\n", admissionTargetMs);
+    log("{ Busy poll budget: %lldus }\n", busyPollMaxBudget);
 
     // Set of socket descriptors
-    fd_set currentSockets, readySockets;
+    fd_set currentSockets, readySockets, writeReadySockets;
 
     // Initialize the set of active sockets
     FD_ZERO(&currentSockets);
     FD_SET(serverSocket, &currentSockets);
 
+    if (argc == 4) {
+        int shardResult = setupShard(atoi(argv[2]), atoi(argv[3]), &currentSockets);
+        if (shardResult == ERROR) {
+            printf("Invalid shard configuration\n");
+            return ERROR;
+        }
+        log("{ Shard %d of %d }\n", shardIndex, shardCount);
+    }
+
     while (true) {
-        readySockets = currentSockets;
+        // Wakes up to fail forwarded clients past their deadline
+        struct timeval shardTimeout;
+        struct timeval* timeout = getShardTimeout(&shardTimeout);
 
         // Wait for an activity on one of the sockets
-        if (select(FD_SETSIZE, &readySockets, NULL, NULL, NULL) < 0) {
+        if (waitForSockets(&currentSockets, &readySockets, &shardWriteSockets, &writeReadySockets, timeout) < 0) {
             printf("Select failed");
             return ERROR;
         }
 
         // Check all sockets for activity
         for (int socket = 0; socket < FD_SETSIZE; socket++) {
-            if (FD_ISSET(socket, &readySockets)) {
+            // Only shard channels with queued messages wait for writes, skip the ones closed earlier in this batch
+            if (FD_ISSET(socket, &writeReadySockets) && FD_ISSET(socket, &shardWriteSockets)) {
+                handleShardWritable(socket, &currentSockets);
+            }
+
+            // Skip sockets closed or paused earlier in this batch
+            if (FD_ISSET(socket, &readySockets) && FD_ISSET(socket, &currentSockets)) {
                 // Accept new connection
                 if (socket == serverSocket) {
                     struct sockaddr_in clientAddress;
                     socklen_t clientAddressSize = sizeof(clientAddress);
                     int clientSocket = accept(serverSocket, (SA*)&clientAddress, &clientAddressSize);
+                    if (clientSocket == ERROR) {
+                        continue;
+                    }
                     FD_SET(clientSocket, &currentSockets);
+                } else if (handleShardEvent(socket, &currentSockets)) {
+                    continue;
                 } else {
                     // Handle client request
                     int clientSocket = socket;
@@ -66,6 +100,24 @@ int main(int argc, char* argv[]) {
 
                     if (bytesRead >= 1 && bytesRead < SOCKET_READ_SIZE) {
                         request[bytesRead] = '\0';
+
+                        // Fail fast when the loop is behind, before any parsing or forwarding
+                        long long arrivedAt = getRequestArrival(clientSocket);
+                        if (shouldShed(arrivedAt)) {
+                            SERVICE_UNAVAILABLE(clientSocket);
+                            close(clientSocket);
+                            FD_CLR(clientSocket, &currentSockets);
+                            continue;
+                        }
+
+                        // The owner answers later, so the client stays open but out of the read set
+                        int owner = getShardOwner(request, bytesRead);
+                        if (owner != shardIndex) {
+                            FD_CLR(clientSocket, &currentSockets);
+                            forwardToOwner(owner, request, bytesRead, arrivedAt, clientSocket, &currentSockets);
+                            continue;
+                        }
+
                         int sentResult = handleRequest(request, bytesRead, clientSocket);
                         if (sentResult == ERROR) {
                             log("{ Error sending response }\n");
@@ -79,6 +131,8 @@ int main(int argc, char* argv[]) {
                 }
             }
         }
+
+        expireShardPending();
     }
 
     close(serverSocket);
@@ -0,0 +1,142 @@
+#ifndef BUSY_POLL_H
+#define BUSY_POLL_H
+
+// Header file for the low latency busy poll mode
+// Spins on non blocking select calls for a budget before blocking, trading cpu for the sleep/wakeup latency
+// The budget adapts: it doubles when spinning finds work after an empty poll and halves when it ends up sleeping anyway
+// Work ready on the first poll is counted apart, it says nothing about whether spinning pays off
+// Configured by env variables, disabled unless BUSY_POLL_US is set:
+//   BUSY_POLL_US: max spin budget in microseconds
+//   BUSY_POLL_SOCKET_US: SO_BUSY_POLL on the server socket, inherited by the accepted sockets
+//     select only busy polls the device queues of sockets with SO_BUSY_POLL set, and only while the host's
+//     net.core.busy_poll sysctl is non zero, raising it above net.core.busy_read may need CAP_NET_ADMIN
+//   BUSY_POLL_CPU: cpu to pin the process to
+// SO_INCOMING_CPU is not set, it only steers connections within a SO_REUSEPORT group and there is a single listener
+// Needs _GNU_SOURCE for sched_setaffinity
+
+#include <sched.h>
+
+#include "httpHandler.h"
+
+// Smallest adaptive budget, as a fraction of BUSY_POLL_US
+#define BUSY_POLL_MIN_BUDGET_DIVISOR 16
+
+long long busyPollMaxBudget = 0;
+long long busyPollMinBudget = 0;
+long long busyPollBudget = 0;
+// Waits that found a ready socket on the first poll, without spinning
+unsigned long busyPollImmediate = 0;
+// Waits that found a ready socket after at least one empty poll, each one is a sleep avoided by spinning
+unsigned long busyPollSpins = 0;
+// Waits that had to block in select
+unsigned long busyPollSleeps = 0;
+
+// Reads the env variables, sets SO_BUSY_POLL on the server socket and pins the cpu
+// Socket option and pinning failures only log a warning, the server runs without them
+void setupBusyPoll(int serverSocket);
+
+// Same as select on all sockets with the given timeout, but spinning for the budget first when enabled
+// The spin counts against the timeout, NULL timeout blocks until a socket is ready
+// Returns the number of ready sockets, 0 on timeout or ERROR
+int waitForSockets(fd_set* currentSockets, fd_set* readySockets,
+                   fd_set* currentWriteSockets, fd_set* writeReadySockets, struct timeval* timeout);
+
+// Prints the immediate, spin and sleep counters
+void printBusyPollStats();
+
+void setupBusyPoll(int serverSocket) {
+    const char* budgetEnv = getenv("BUSY_POLL_US");
+    if (budgetEnv != NULL) {
+        busyPollMaxBudget = atoll(budgetEnv);
+        busyPollBudget = busyPollMaxBudget;
+        busyPollMinBudget = busyPollMaxBudget / BUSY_POLL_MIN_BUDGET_DIVISOR;
+        if (busyPollMinBudget < 1) {
+            busyPollMinBudget = 1;
+        }
+    }
+
+    const char* socketBusyPollEnv = getenv("BUSY_POLL_SOCKET_US");
+    if (socketBusyPollEnv != NULL) {
+        int socketBusyPoll = atoi(socketBusyPollEnv);
+        if (setsockopt(serverSocket, SOL_SOCKET, SO_BUSY_POLL, &socketBusyPoll, sizeof(socketBusyPoll)) == ERROR) {
+            perror("Failed to set SO_BUSY_POLL");
+        }
+    }
+
+    const char* cpuEnv = getenv("BUSY_POLL_CPU");
+    if (cpuEnv != NULL) {
+        int cpu = atoi(cpuEnv);
+        cpu_set_t cpuSet;
+        CPU_ZERO(&cpuSet);
+        CPU_SET(cpu, &cpuSet);
+        if (sched_setaffinity(0, sizeof(cpuSet), &cpuSet) == ERROR) {
+            perror("Failed to pin cpu");
+        }
+    }
+}
+
+int waitForSockets(fd_set* currentSockets, fd_set* readySockets,
+                   fd_set* currentWriteSockets, fd_set* writeReadySockets, struct timeval* timeout) {
+    struct timeval remaining;
+    if (busyPollMaxBudget > 0) {
+        long long spinStart = getMonotonicMicros();
+        long long timeoutMicros = timeout == NULL ? 0 : timeout->tv_sec * 1000000LL + timeout->tv_usec;
+        long long spinLimit = busyPollBudget;
+        if (timeout != NULL && timeoutMicros < spinLimit) {
+            spinLimit = timeoutMicros;
+        }
+        bool polledEmpty = false;
+        do {
+            *readySockets = *currentSockets;
+            *writeReadySockets = *currentWriteSockets;
+            struct timeval noWait = {0, 0};
+            int readyCount = select(FD_SETSIZE, readySockets, writeReadySockets, NULL, &noWait);
+            if (readyCount < 0) {
+                return readyCount;
+            }
+            if (readyCount > 0 && !polledEmpty) {
+                busyPollImmediate++;
+                return readyCount;
+            }
+            if (readyCount > 0) {
+                busyPollSpins++;
+                busyPollBudget *= 2;
+                if (busyPollBudget > busyPollMaxBudget) {
+                    busyPollBudget = busyPollMaxBudget;
+                }
+                return readyCount;
+            }
+            polledEmpty = true;
+        } while (getMonotonicMicros() - spinStart < spinLimit);
+
+        // Only a spin that used its whole budget says the budget is too big
+        if (spinLimit == busyPollBudget) {
+            busyPollBudget /= 2;
+            if (busyPollBudget < busyPollMinBudget) {
+                busyPollBudget = busyPollMinBudget;
+            }
+        }
+
+        if (timeout != NULL) {
+            long long remainingMicros = timeoutMicros - (getMonotonicMicros() - spinStart);
+            if (remainingMicros <= 0) {
+                // The last poll was empty, so this is a timeout
+                return 0;
+            }
+            remaining.tv_sec = remainingMicros / 1000000;
+            remaining.tv_usec = remainingMicros % 1000000;
+            timeout = &remaining;
+        }
+    }
+
+    busyPollSleeps++;
+    *readySockets = *currentSockets;
+    *writeReadySockets = *currentWriteSockets;
+    return select(FD_SETSIZE, readySockets, writeReadySockets, NULL, timeout);
+}
+
+void printBusyPollStats() {
+    printf("{ Immediate: %lu, Spins: %lu, Sleeps: %lu, Spin budget: %lldus }\n",
+           busyPollImmediate, busyPollSpins, busyPollSleeps, busyPollBudget);
+}
+#endif
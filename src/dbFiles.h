@@ -50,6 +50,13 @@ typedef struct USER {
     Transaction transactions[MAX_TRANSACTIONS];
 } User;
 
+// In-memory user store, used in sharded mode where this instance is the authority for the users it owns
+// Ids are a single digit in the request path
+#define MAX_USER_ID 9
+bool inMemoryDb = false;
+User memoryUsers[MAX_USER_ID + 1];
+bool memoryUserLoaded[MAX_USER_ID + 1];
+
 // Initializes the database with 5 users
 // Returns ERROR it fails to write a user to the file
 // Returns SUCCESS if the database was successfully initialized
@@ -80,6 +87,20 @@ int addTransaction(User* user, Transaction* transaction);
 // Returns ERROR if the user doesn't have enough limit
 int addSaldo(User* user, Transaction* transaction);
 
+// Loads the users owned by this shard (id % shardCount == shardIndex) into memory
+// With RESET_DB the users are built from userInitialLimits, otherwise they are read once from their files
+// Sets inMemoryDb so the handlers stop touching the files
+// Returns ERROR if an owned user file exists but can't be read
+int initMemoryDb(int shardIndex, int shardCount);
+
+// Same as readUser, but from the in-memory store
+// Returns ERROR if the user is not loaded
+int readMemoryUser(User* user, int id);
+
+// Same as updateUserWithTransaction, but on the in-memory store, so no locking is needed
+// returns FILE_NOT_FOUND if the user is not loaded
+int updateMemoryUserWithTransaction(int id, Transaction* transaction, User* user);
+
 // Fills the orderedTransactions array with the user's transactions ordered by the oldest
 
 int initDb() {
@@ -161,6 +182,56 @@ int updateUserWithTransaction(int id, Transaction* transaction, User* user) {
     return transactionResult;
 }
 
+int initMemoryDb(int shardIndex, int shardCount) {
+    for (int id = 0; id <= MAX_USER_ID; id++) {
+        memoryUserLoaded[id] = false;
+        if (id % shardCount != shardIndex) {
+            continue;
+        }
+#ifdef RESET_DB
+        if (id < 1 || id > numberInitialUsers) {
+            continue;
+        }
+        User* user = &memoryUsers[id];
+        user->id = id;
+        user->limit = userInitialLimits[id - 1];
+        user->total = 0;
+        user->nTransactions = 0;
+        user->oldestTransaction = 0;
+#else
+        char fname[FILE_NAME_SIZE];
+        sprintf(fname, userFileTemplate, id);
+        if (access(fname, F_OK) != 0) {
+            continue;
+        }
+        int readResult = readUser(&memoryUsers[id], id);
+        raiseIfError(readResult);
+#endif
+        memoryUserLoaded[id] = true;
+    }
+
+    inMemoryDb = true;
+    return SUCCESS;
+}
+
+int readMemoryUser(User* user, int id) {
+    if (id < 0 || id > MAX_USER_ID || !memoryUserLoaded[id]) {
+        return ERROR;
+    }
+    *user = memoryUsers[id];
+    return SUCCESS;
+}
+
+int updateMemoryUserWithTransaction(int id, Transaction* transaction, User* user) {
+    if (id < 0 || id > MAX_USER_ID || !memoryUserLoaded[id]) {
+        return FILE_NOT_FOUND;
+    }
+    // addTransaction only changes the user when it succeeds
+    int transactionResult = addTransaction(&memoryUsers[id], transaction);
+    *user = memoryUsers[id];
+    return transactionResult;
+}
+
 int addTransaction(User* user, Transaction* transaction) {
     int resultSaldo = addSaldo(user, transaction);
     if (resultSaldo != SUCCESS) {
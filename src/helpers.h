@@ -19,6 +19,7 @@
 #include <sys/socket.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 // Custom error codes
@@ -27,6 +28,7 @@
 #define FILE_NOT_FOUND -2
 #define LIMIT_EXCEEDED_ERROR -3
 #define INVALID_TIPO_ERROR -4
+#define QUEUE_FULL_ERROR -5
 
 // Return error if pointer is NULL
 #define errIfNull(pointer) \
@@ -50,11 +52,11 @@
 const char* successResponseJsonTemplate = "HTTP/1.1 200 OK\nContent-Type: application/json\n\n%s";
 
 // Send response to client
-#define RESPOND(clientSocket, response) send(clientSocket, response, strlen(response), SEND_DEFAULT);
+#define RESPOND(clientSocket, response) sendResponse(clientSocket, response, strlen(response));
 
 // static responses
 // response must be a string literal
-#define STATIC_RESPONSE(clientSocket, response) send(clientSocket, response, sizeof(response) - 1, SEND_DEFAULT);
+#define STATIC_RESPONSE(clientSocket, response) sendResponse(clientSocket, response, sizeof(response) - 1);
 
 const char badRequestResponse[] = "HTTP/1.1 400 Bad Request\nContent-Type: application/json\n\n{\"message\": \"Bad Request\"}";
 #define BAD_REQUEST(clientSocket) STATIC_RESPONSE(clientSocket, badRequestResponse)
@@ -71,6 +73,13 @@ const char unprocessableEntityResponse[] = "HTTP/1.1 422 Unprocessable Entity\nC
 const char internalServerErrorResponse[] = "HTTP/1.1 500 Internal Server Error\nContent-Type: application/json\n\n{\"message\": \"Internal Server Error\"}";
 #define INTERNAL_SERVER_ERROR(clientSocket) STATIC_RESPONSE(clientSocket, internalServerErrorResponse)
 
+const char serviceUnavailableResponse[] = "HTTP/1.1 503 Service Unavailable\nRetry-After: 1\nContent-Type: application/json\n\n{\"message\": \"Service Unavailable\"}";
+#define SERVICE_UNAVAILABLE(clientSocket) STATIC_RESPONSE(clientSocket, serviceUnavailableResponse)
+
+// The request may still be applied, so no Retry-After
+const char gatewayTimeoutResponse[] = "HTTP/1.1 504 Gateway Timeout\nContent-Type: application/json\n\n{\"message\": \"Gateway Timeout\"}";
+#define GATEWAY_TIMEOUT(clientSocket) STATIC_RESPONSE(clientSocket, gatewayTimeoutResponse)
+
 // HTTP methods
 const char GET_METHOD[] = "GET";
 const int GET_METHOD_LENGTH = sizeof(GET_METHOD) - 1;
@@ -90,6 +99,9 @@ int partialEqual(const char* str1, const char* str2, int maxLength);
 // Gets system time and stores it in timeStr
 void getCurrentTimeStr(char* timeStr);
 
+// Monotonic clock in microseconds, for measuring durations
+long long getMonotonicMicros();
+
 int check(int expression, const char* message) {
     if (expression == ERROR) {
         perror(message);
@@ -116,4 +128,10 @@ void getCurrentTimeStr(char* timeStr) {
     time_str[strlen(time_str) - 1] = '\0';
     strcpy(timeStr, time_str);
 }
+
+long long getMonotonicMicros() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 #endif
\ No newline at end of file
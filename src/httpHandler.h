@@ -36,6 +36,15 @@
 #define SEND_DEFAULT 0
 #define PROTOCOL_DEFAULT 0
 
+// When set, responses are copied here instead of being sent, so they can be queued on a non blocking channel
+// Must hold RESPONSE_SIZE bytes
+char* capturedResponse = NULL;
+int capturedResponseSize = 0;
+
+// Sends the response to the clientSocket, or copies it to capturedResponse when set
+// Returns the number of bytes sent or ERROR
+int sendResponse(int clientSocket, const char* response, int responseSize);
+
 // Startup server socket on the given port, with the max number of connections waiting to be accepted set to backlog
 // Crash the program if the socket creation or binding fails
 int setupServer(short port, int backlog);
@@ -67,6 +76,15 @@ int getTransactionFromBody(char* request, Transaction* transaction);
 // Serializes POST transaction response into json and writes it to response
 void serializePostResponse(User* user, char* response);
 
+int sendResponse(int clientSocket, const char* response, int responseSize) {
+    if (capturedResponse != NULL) {
+        memcpy(capturedResponse, response, responseSize);
+        capturedResponseSize = responseSize;
+        return responseSize;
+    }
+    return send(clientSocket, response, responseSize, SEND_DEFAULT);
+}
+
 int setupServer(short port, int backlog) {
     int serverSocket;
     check((serverSocket = socket(AF_INET, SOCK_STREAM, PROTOCOL_DEFAULT)), "Failed to create socket");
@@ -127,7 +145,7 @@ int handleGetRequest(int clientSocket, char* request, int requestSize) {
 
     // get user from db by id
     User user;
-    int readResult = readUser(&user, id);
+    int readResult = inMemoryDb ? readMemoryUser(&user, id) : readUser(&user, id);
     if (readResult == ERROR) {
         log("[ NOT_FOUND - file ]\n");
         return NOT_FOUND(clientSocket);
@@ -214,7 +232,8 @@ int handlePostRequest(int clientSocket, char* request, int requestSize) {
 
     // update user on db by id
     User user;
-    int transactionResult = updateUserWithTransaction(id, &transaction, &user);
+    int transactionResult = inMemoryDb ? updateMemoryUserWithTransaction(id, &transaction, &user)
+                                       : updateUserWithTransaction(id, &transaction, &user);
 
     if (transactionResult == ERROR) {
         log("[ Internal Server Error - Locking file ]\n");
@@ -0,0 +1,481 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// Header file for account ownership sharding
+// Each instance owns the users with id % shardCount == shardIndex and keeps them in memory as the authority
+// Requests for users owned by another instance are forwarded to the owner over a persistent unix socket
+// The sockets are SOCK_SEQPACKET, so one request is one message and one response is one message
+// The channels are non blocking, messages that can't be sent right away wait in a per channel outbox
+// flushed when select reports the channel writable, so two instances never block on each other
+
+#include <sys/un.h>
+
+#include "admission.h"
+
+#define MAX_SHARDS 8
+// Lives in the data folder, which is shared between the instances
+#define SHARD_SOCKET_TEMPLATE "data/shard%d.sock"
+#define SHARD_SOCKET_BACKLOG 16
+// Bytes queued per channel, a forwarded request is failed when its channel is full
+#define SHARD_OUTBOX_SIZE 128 * 1024
+// Outbox messages are prefixed by their length
+#define SHARD_MESSAGE_HEADER_SIZE ((int)sizeof(int))
+// Max messages read from a channel per select wakeup
+#define SHARD_BATCH_SIZE 64
+// Max time a client waits for the owner's response, the admission target applies too when it's shorter
+// The request is already on its way to the owner and may still be applied, so the client gets a 504, not a 503
+#define SHARD_FORWARD_TIMEOUT_MS 1000
+// How often waiting clients are checked against their deadline
+#define SHARD_EXPIRE_INTERVAL_MS 10
+
+// Kinds of sockets the event loop may get from the sharding layer
+#define SHARD_FD_NONE 0
+#define SHARD_FD_LISTENER 1
+#define SHARD_FD_INBOUND 2
+#define SHARD_FD_OUTBOUND 3
+
+// Sharding is disabled while shardCount is 0
+int shardIndex = 0;
+int shardCount = 0;
+int shardListener = ERROR;
+char shardSocketPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+
+// Persistent channel to each owner, ERROR until the first request is forwarded to it
+int shardChannels[MAX_SHARDS];
+char shardFdKinds[FD_SETSIZE];
+int shardOwnerByFd[FD_SETSIZE];
+
+// Sent before the request bytes, so the owner can shed requests that already waited too long
+typedef struct FORWARDED_REQUEST_HEADER {
+    long long arrivedAt;
+} ForwardedRequestHeader;
+
+typedef struct SHARD_OUTBOX {
+    int used;
+    char data[SHARD_OUTBOX_SIZE];
+} ShardOutbox;
+
+// Allocated for inbound and outbound channels only
+ShardOutbox* shardOutboxes[FD_SETSIZE];
+// Channels with queued messages, select waits for them to be writable
+fd_set shardWriteSockets;
+
+typedef struct PENDING_CLIENT {
+    // ERROR once the client was failed, the owner's response is then discarded
+    int clientSocket;
+    long long deadline;
+} PendingClient;
+
+// Client sockets waiting for a response from each owner, in the order their requests were forwarded
+// The owner answers in order on a single channel, so a ring per owner matches responses to clients
+typedef struct PENDING_CLIENTS {
+    PendingClient clients[FD_SETSIZE];
+    int head, count;
+} PendingClients;
+
+PendingClients shardPending[MAX_SHARDS];
+// Clients still waiting on any owner
+int shardLivePending = 0;
+long long shardLastExpireCheck = 0;
+
+// Loads the owned users in memory and starts listening for forwarded requests on SHARD_SOCKET_TEMPLATE
+// Returns ERROR if the shard configuration is invalid or the users can't be loaded
+// Crash the program if the socket creation or binding fails
+int setupShard(int index, int count, fd_set* currentSockets);
+
+// Removes the shard socket file
+void closeShard();
+
+// Returns the index of the instance that owns the user in the request
+// Returns shardIndex if sharding is disabled or the request has no valid id, so it is handled locally
+int getShardOwner(const char* request, int requestSize);
+
+// Queues the request for the owner and keeps the client until the owner answers or the deadline passes
+// The client is answered and closed here if the owner can't be reached or its channel is full
+int forwardToOwner(int owner, const char* request, int requestSize, long long arrivedAt, int clientSocket, fd_set* currentSockets);
+
+// Handles activity on a shard socket
+// Returns false if the socket isn't a shard socket
+bool handleShardEvent(int socket, fd_set* currentSockets);
+
+// Sends the queued messages of a channel reported writable by select
+// Does nothing if the channel was closed earlier in the same batch
+void handleShardWritable(int socket, fd_set* currentSockets);
+
+// Fails the clients that waited past their deadline, at most every SHARD_EXPIRE_INTERVAL_MS
+void expireShardPending();
+
+// Sets timeout to the next deadline check and returns it, or NULL if no client is waiting
+struct timeval* getShardTimeout(struct timeval* timeout);
+
+int setupShard(int index, int count, fd_set* currentSockets) {
+    if (count < 1 || count > MAX_SHARDS || index < 0 || index >= count) {
+        return ERROR;
+    }
+    shardIndex = index;
+    shardCount = count;
+
+    int loadResult = initMemoryDb(shardIndex, shardCount);
+    raiseIfError(loadResult);
+
+    for (int owner = 0; owner < MAX_SHARDS; owner++) {
+        shardChannels[owner] = ERROR;
+        shardPending[owner].head = 0;
+        shardPending[owner].count = 0;
+    }
+    FD_ZERO(&shardWriteSockets);
+
+    // A peer that died while a response was being sent would kill this instance otherwise
+    signal(SIGPIPE, SIG_IGN);
+
+    check((shardListener = socket(AF_UNIX, SOCK_SEQPACKET, PROTOCOL_DEFAULT)), "Failed to create shard socket");
+
+    struct sockaddr_un shardAddress;
+    memset(&shardAddress, 0, sizeof(shardAddress));
+    shardAddress.sun_family = AF_UNIX;
+    snprintf(shardSocketPath, sizeof(shardSocketPath), SHARD_SOCKET_TEMPLATE, shardIndex);
+    strcpy(shardAddress.sun_path, shardSocketPath);
+
+    // Left behind if the previous run was killed
+    unlink(shardSocketPath);
+    check(bind(shardListener, (SA*)&shardAddress, sizeof(shardAddress)), "Failed to bind shard socket");
+    check(listen(shardListener, SHARD_SOCKET_BACKLOG), "Failed to listen on shard socket");
+
+    shardFdKinds[shardListener] = SHARD_FD_LISTENER;
+    FD_SET(shardListener, currentSockets);
+    return SUCCESS;
+}
+
+void closeShard() {
+    if (shardListener == ERROR) {
+        return;
+    }
+    close(shardListener);
+    unlink(shardSocketPath);
+}
+
+int getShardOwner(const char* request, int requestSize) {
+    if (shardCount == 0) {
+        return shardIndex;
+    }
+
+    int id = ERROR;
+    if (partialEqual(request, GET_METHOD, GET_METHOD_LENGTH)) {
+        id = getIdFromGETRequest(request, requestSize);
+    } else if (partialEqual(request, POST_METHOD, POST_METHOD_LENGTH)) {
+        id = getIdFromPOSTRequest(request, requestSize);
+    }
+
+    if (id == ERROR) {
+        return shardIndex;
+    }
+    return id % shardCount;
+}
+
+// Registers a connected non blocking channel in the event loop with an empty outbox
+void openShardChannel(int channel, int kind, fd_set* currentSockets) {
+    shardFdKinds[channel] = kind;
+    shardOutboxes[channel] = malloc(sizeof(ShardOutbox));
+    shardOutboxes[channel]->used = 0;
+    FD_SET(channel, currentSockets);
+}
+
+// Closes the channel and drops its queued messages
+void closeShardChannel(int channel, fd_set* currentSockets) {
+    close(channel);
+    FD_CLR(channel, currentSockets);
+    FD_CLR(channel, &shardWriteSockets);
+    shardFdKinds[channel] = SHARD_FD_NONE;
+    free(shardOutboxes[channel]);
+    shardOutboxes[channel] = NULL;
+}
+
+bool outboxHasRoom(int channel, int messageSize) {
+    return shardOutboxes[channel]->used + SHARD_MESSAGE_HEADER_SIZE + messageSize <= SHARD_OUTBOX_SIZE;
+}
+
+// Sends the queued messages until the channel would block
+// Returns ERROR if the channel failed
+int flushShardOutbox(int channel) {
+    ShardOutbox* outbox = shardOutboxes[channel];
+    int offset = 0;
+    while (offset < outbox->used) {
+        int messageSize;
+        memcpy(&messageSize, &outbox->data[offset], SHARD_MESSAGE_HEADER_SIZE);
+        int sent = send(channel, &outbox->data[offset + SHARD_MESSAGE_HEADER_SIZE], messageSize, MSG_DONTWAIT);
+        if (sent == ERROR) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            return ERROR;
+        }
+        offset += SHARD_MESSAGE_HEADER_SIZE + messageSize;
+    }
+
+    memmove(outbox->data, &outbox->data[offset], outbox->used - offset);
+    outbox->used -= offset;
+    if (outbox->used == 0) {
+        FD_CLR(channel, &shardWriteSockets);
+    } else {
+        FD_SET(channel, &shardWriteSockets);
+    }
+    return SUCCESS;
+}
+
+// Queues the message behind the ones already waiting and sends as much as the channel takes
+// Returns QUEUE_FULL_ERROR if the outbox has no room for the message
+// Returns ERROR if the channel failed
+int queueShardMessage(int channel, const char* message, int messageSize) {
+    if (!outboxHasRoom(channel, messageSize)) {
+        return QUEUE_FULL_ERROR;
+    }
+    ShardOutbox* outbox = shardOutboxes[channel];
+    memcpy(&outbox->data[outbox->used], &messageSize, SHARD_MESSAGE_HEADER_SIZE);
+    memcpy(&outbox->data[outbox->used + SHARD_MESSAGE_HEADER_SIZE], message, messageSize);
+    outbox->used += SHARD_MESSAGE_HEADER_SIZE + messageSize;
+    return flushShardOutbox(channel);
+}
+
+// Connects to the owner's shard socket if there is no channel yet
+// Returns ERROR if the owner isn't listening or its backlog is full
+int connectToOwner(int owner, fd_set* currentSockets) {
+    if (shardChannels[owner] != ERROR) {
+        return shardChannels[owner];
+    }
+
+    int channel = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, PROTOCOL_DEFAULT);
+    raiseIfError(channel);
+
+    struct sockaddr_un ownerAddress;
+    memset(&ownerAddress, 0, sizeof(ownerAddress));
+    ownerAddress.sun_family = AF_UNIX;
+    snprintf(ownerAddress.sun_path, sizeof(ownerAddress.sun_path), SHARD_SOCKET_TEMPLATE, owner);
+
+    if (connect(channel, (SA*)&ownerAddress, sizeof(ownerAddress)) == ERROR) {
+        close(channel);
+        return ERROR;
+    }
+
+    log("{ Connected to shard %d(%d) }\n", owner, channel);
+    shardChannels[owner] = channel;
+    shardOwnerByFd[channel] = owner;
+    openShardChannel(channel, SHARD_FD_OUTBOUND, currentSockets);
+    return channel;
+}
+
+// Removes the oldest pending client of the owner and returns its socket, ERROR if it was already failed
+int popPendingClient(int owner) {
+    PendingClients* pending = &shardPending[owner];
+    int clientSocket = pending->clients[pending->head].clientSocket;
+    pending->head = (pending->head + 1) % FD_SETSIZE;
+    pending->count--;
+    if (clientSocket != ERROR) {
+        shardLivePending--;
+    }
+    return clientSocket;
+}
+
+// Closes the channel to the owner and fails every client still waiting on it
+void dropOwnerChannel(int owner, fd_set* currentSockets) {
+    int channel = shardChannels[owner];
+    log("{ Lost shard %d(%d) }\n", owner, channel);
+    closeShardChannel(channel, currentSockets);
+    shardChannels[owner] = ERROR;
+
+    while (shardPending[owner].count > 0) {
+        int clientSocket = popPendingClient(owner);
+        if (clientSocket != ERROR) {
+            INTERNAL_SERVER_ERROR(clientSocket);
+            close(clientSocket);
+        }
+    }
+    shardPending[owner].head = 0;
+}
+
+int forwardToOwner(int owner, const char* request, int requestSize, long long arrivedAt, int clientSocket, fd_set* currentSockets) {
+    int channel = connectToOwner(owner, currentSockets);
+    if (channel == ERROR) {
+        log("[ Internal Server Error - Shard %d unreachable ]\n", owner);
+        INTERNAL_SERVER_ERROR(clientSocket);
+        close(clientSocket);
+        return ERROR;
+    }
+
+    char message[sizeof(ForwardedRequestHeader) + SOCKET_READ_SIZE];
+    ForwardedRequestHeader header = {arrivedAt};
+    memcpy(message, &header, sizeof(header));
+    memcpy(&message[sizeof(header)], request, requestSize);
+    int messageSize = sizeof(header) + requestSize;
+
+    PendingClients* pending = &shardPending[owner];
+    int queueResult = pending->count == FD_SETSIZE ? QUEUE_FULL_ERROR : queueShardMessage(channel, message, messageSize);
+    if (queueResult == QUEUE_FULL_ERROR) {
+        log("[ Service Unavailable - Shard %d queue full ]\n", owner);
+        SERVICE_UNAVAILABLE(clientSocket);
+        close(clientSocket);
+        return ERROR;
+    }
+    if (queueResult == ERROR) {
+        log("[ Internal Server Error - Forwarding to shard %d ]\n", owner);
+        INTERNAL_SERVER_ERROR(clientSocket);
+        close(clientSocket);
+        dropOwnerChannel(owner, currentSockets);
+        return ERROR;
+    }
+
+    PendingClient* entry = &pending->clients[(pending->head + pending->count) % FD_SETSIZE];
+    entry->clientSocket = clientSocket;
+    entry->deadline = getAdmissionDeadline(arrivedAt, getMonotonicMicros() + SHARD_FORWARD_TIMEOUT_MS * 1000LL);
+    pending->count++;
+    shardLivePending++;
+    return SUCCESS;
+}
+
+// Reads the owner's responses and relays each one to the oldest waiting client
+void relayOwnerResponses(int channel, fd_set* currentSockets) {
+    int owner = shardOwnerByFd[channel];
+    char response[RESPONSE_SIZE];
+    for (int i = 0; i < SHARD_BATCH_SIZE; i++) {
+        int bytesRead = recv(channel, response, sizeof(response), MSG_DONTWAIT);
+        if (bytesRead == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        if (bytesRead <= 0) {
+            dropOwnerChannel(owner, currentSockets);
+            return;
+        }
+
+        if (shardPending[owner].count == 0) {
+            log("{ Unexpected response from shard %d }\n", owner);
+            continue;
+        }
+        int clientSocket = popPendingClient(owner);
+        if (clientSocket == ERROR) {
+            // Already answered when its deadline passed
+            continue;
+        }
+        send(clientSocket, response, bytesRead, SEND_DEFAULT);
+        close(clientSocket);
+    }
+}
+
+// Handles the requests forwarded by another instance, the responses are queued back as single messages
+// Requests that waited past the admission target minus FORWARDED_ADMISSION_MARGIN_MS since they arrived are shed
+// Stops reading the peer while its outbox can't take another response, the flush resumes it
+void serveForwardedRequests(int peer, fd_set* currentSockets) {
+    char message[sizeof(ForwardedRequestHeader) + SOCKET_READ_SIZE];
+    char response[RESPONSE_SIZE];
+    for (int i = 0; i < SHARD_BATCH_SIZE; i++) {
+        if (!outboxHasRoom(peer, RESPONSE_SIZE)) {
+            FD_CLR(peer, currentSockets);
+            return;
+        }
+
+        int bytesRead = recv(peer, message, sizeof(message), MSG_DONTWAIT);
+        if (bytesRead == ERROR && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        }
+        int requestSize = bytesRead - (int)sizeof(ForwardedRequestHeader);
+        if (requestSize <= 0 || requestSize >= SOCKET_READ_SIZE) {
+            closeShardChannel(peer, currentSockets);
+            return;
+        }
+
+        ForwardedRequestHeader header;
+        memcpy(&header, message, sizeof(header));
+        char* request = &message[sizeof(header)];
+        request[requestSize] = '\0';
+
+        capturedResponse = response;
+        if (shouldShedForwarded(header.arrivedAt)) {
+            SERVICE_UNAVAILABLE(peer);
+        } else {
+            handleRequest(request, requestSize, peer);
+        }
+        capturedResponse = NULL;
+
+        if (queueShardMessage(peer, response, capturedResponseSize) == ERROR) {
+            log("{ Error sending response to shard }\n");
+            closeShardChannel(peer, currentSockets);
+            return;
+        }
+    }
+}
+
+bool handleShardEvent(int socket, fd_set* currentSockets) {
+    switch (shardFdKinds[socket]) {
+        case SHARD_FD_LISTENER: {
+            int peer = accept4(shardListener, NULL, NULL, SOCK_NONBLOCK);
+            if (peer != ERROR) {
+                openShardChannel(peer, SHARD_FD_INBOUND, currentSockets);
+            }
+            return true;
+        }
+        case SHARD_FD_INBOUND:
+            serveForwardedRequests(socket, currentSockets);
+            return true;
+        case SHARD_FD_OUTBOUND:
+            relayOwnerResponses(socket, currentSockets);
+            return true;
+        default:
+            return false;
+    }
+}
+
+void handleShardWritable(int socket, fd_set* currentSockets) {
+    // A forward earlier in the batch may have dropped this channel after select reported it
+    if (shardOutboxes[socket] == NULL) {
+        return;
+    }
+    int kind = shardFdKinds[socket];
+    if (flushShardOutbox(socket) == ERROR) {
+        if (kind == SHARD_FD_OUTBOUND) {
+            dropOwnerChannel(shardOwnerByFd[socket], currentSockets);
+        } else {
+            closeShardChannel(socket, currentSockets);
+        }
+        return;
+    }
+
+    // Resume reading a peer that was paused because its outbox was full
+    if (kind == SHARD_FD_INBOUND && outboxHasRoom(socket, RESPONSE_SIZE)) {
+        FD_SET(socket, currentSockets);
+    }
+}
+
+void expireShardPending() {
+    if (shardLivePending == 0) {
+        return;
+    }
+    long long now = getMonotonicMicros();
+    if (now - shardLastExpireCheck < SHARD_EXPIRE_INTERVAL_MS * 1000LL) {
+        return;
+    }
+    shardLastExpireCheck = now;
+
+    for (int owner = 0; owner < shardCount; owner++) {
+        PendingClients* pending = &shardPending[owner];
+        for (int i = 0; i < pending->count; i++) {
+            PendingClient* entry = &pending->clients[(pending->head + i) % FD_SETSIZE];
+            if (entry->clientSocket == ERROR || entry->deadline > now) {
+                continue;
+            }
+            // The entry stays until the owner answers, so the responses still match the clients in order
+            log("[ Gateway Timeout - Shard %d timed out ]\n", owner);
+            GATEWAY_TIMEOUT(entry->clientSocket);
+            close(entry->clientSocket);
+            entry->clientSocket = ERROR;
+            shardLivePending--;
+        }
+    }
+}
+
+struct timeval* getShardTimeout(struct timeval* timeout) {
+    if (shardLivePending == 0) {
+        return NULL;
+    }
+    timeout->tv_sec = 0;
+    timeout->tv_usec = SHARD_EXPIRE_INTERVAL_MS * 1000;
+    return timeout;
+}
+#endif